@@ -3,6 +3,21 @@
 #include <functional>
 #include <memory>
 #include <array>
+#include <exception>
+#include <algorithm>
+#include <tuple>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+#if __cplusplus >= 202002L
+ #include <atomic>
+ #include <condition_variable>
+ #include <coroutine>
+ #include <mutex>
+ #include <thread>
+#endif
 
 //=============================================================================
 namespace inheritance_heap {
@@ -35,6 +50,49 @@ public:
         return *this;
     }
 
+    template <typename Functor,
+              typename = typename std::enable_if<! std::is_same<typename std::decay<Functor>::type, function>::value>::type>
+    function& operator= (Functor&& f)
+    {
+        emplace<typename std::decay<Functor>::type> (std::forward<Functor> (f));
+        return *this;
+    }
+
+    template <typename Functor, typename... Args>
+    void emplace (Args&&... args)
+    {
+        using Holder = FunctorHolder<Functor, Result, Arguments...>;
+
+        auto* oldPtr = functorHolderPtr;
+        functorHolderPtr = nullptr;
+
+        if (oldPtr == nullptr)
+        {
+            functorHolderPtr = new Holder (std::forward<Args> (args)...);
+            return;
+        }
+
+        // If the current target has the same type then its heap block can be reused
+        if (oldPtr->getTypeTag() != Holder::getStaticTypeTag())
+        {
+            delete oldPtr;
+            functorHolderPtr = new Holder (std::forward<Args> (args)...);
+            return;
+        }
+
+        oldPtr->~FunctorHolderBase();
+
+        try
+        {
+            functorHolderPtr = new (oldPtr) Holder (std::forward<Args> (args)...);
+        }
+        catch (...)
+        {
+            ::operator delete (oldPtr);
+            throw;
+        }
+    }
+
     function() = default;
 
     ~function()
@@ -54,12 +112,14 @@ private:
         virtual ~FunctorHolderBase() {}
         virtual ReturnType operator()(Args&&...) = 0;
         virtual FunctorHolderBase* clone() const = 0;
+        virtual const void* getTypeTag() const = 0;
     };
 
     template <typename Functor, typename ReturnType, typename... Args>
     struct FunctorHolder final : FunctorHolderBase<Result, Arguments...>
     {
-        FunctorHolder (Functor func) : f (func) {}
+        template <typename... CtorArgs>
+        FunctorHolder (CtorArgs&&... ctorArgs) : f (std::forward<CtorArgs> (ctorArgs)...) {}
 
         ReturnType operator()(Args&&... args) override
         {
@@ -71,6 +131,18 @@ private:
             return new FunctorHolder (f);
         }
 
+        // Identifies the holder's type without needing RTTI
+        const void* getTypeTag() const override
+        {
+            return getStaticTypeTag();
+        }
+
+        static const void* getStaticTypeTag()
+        {
+            static const char tag = 0;
+            return &tag;
+        }
+
         Functor f;
     };
 
@@ -123,6 +195,30 @@ public:
         return *this;
     }
 
+    template <typename Functor,
+              typename = typename std::enable_if<! std::is_same<typename std::decay<Functor>::type, function>::value>::type>
+    function& operator= (Functor&& f)
+    {
+        emplace<typename std::decay<Functor>::type> (std::forward<Functor> (f));
+        return *this;
+    }
+
+    template <typename Functor, typename... Args>
+    void emplace (Args&&... args)
+    {
+        using Holder = FunctorHolder<Functor, Result, Arguments...>;
+        static_assert (sizeof (Holder) <= sizeof (stack), "Too big!");
+
+        if (functorHolderPtr != nullptr)
+        {
+            functorHolderPtr->~FunctorHolderBase<Result, Arguments...>();
+            functorHolderPtr = nullptr;
+        }
+
+        new (std::addressof (stack)) Holder (std::forward<Args> (args)...);
+        functorHolderPtr = (FunctorHolderBase<Result, Arguments...>*) std::addressof (stack);
+    }
+
     function() = default;
 
     ~function()
@@ -148,7 +244,8 @@ private:
     template <typename Functor, typename ReturnType, typename... Args>
     struct FunctorHolder final : FunctorHolderBase<Result, Arguments...>
     {
-        FunctorHolder (Functor func) : f (func) {}
+        template <typename... CtorArgs>
+        FunctorHolder (CtorArgs&&... ctorArgs) : f (std::forward<CtorArgs> (ctorArgs)...) {}
 
         ReturnType operator()(Args&&... args) override
         {
@@ -237,6 +334,65 @@ public:
         return *this;
     }
 
+    template <typename Functor,
+              typename = typename std::enable_if<! std::is_same<typename std::decay<Functor>::type, function>::value>::type>
+    function& operator= (Functor&& f)
+    {
+        emplace<typename std::decay<Functor>::type> (std::forward<Functor> (f));
+        return *this;
+    }
+
+    template <typename Functor, typename... Args>
+    void emplace (Args&&... args)
+    {
+        using Holder = FunctorHolder<Functor, Result, Arguments...>;
+
+        auto* stackPtr = (decltype (functorHolderPtr)) std::addressof (stack);
+        decltype (functorHolderPtr) heapBlock = nullptr;
+
+        if (functorHolderPtr != nullptr)
+        {
+            // If the current target has the same type then its heap block can be reused
+            if (functorHolderPtr != stackPtr && functorHolderPtr->getTypeTag() == Holder::getStaticTypeTag())
+            {
+                heapBlock = functorHolderPtr;
+                functorHolderPtr->~FunctorHolderBase();
+            }
+            else if (functorHolderPtr == stackPtr)
+            {
+                functorHolderPtr->~FunctorHolderBase();
+            }
+            else
+            {
+                delete functorHolderPtr;
+            }
+
+            functorHolderPtr = nullptr;
+        }
+
+        if (sizeof (Holder) <= sizeof (stack))
+        {
+            new (stackPtr) Holder (std::forward<Args> (args)...);
+            functorHolderPtr = stackPtr;
+        }
+        else if (heapBlock == nullptr)
+        {
+            functorHolderPtr = new Holder (std::forward<Args> (args)...);
+        }
+        else
+        {
+            try
+            {
+                functorHolderPtr = new (heapBlock) Holder (std::forward<Args> (args)...);
+            }
+            catch (...)
+            {
+                ::operator delete (heapBlock);
+                throw;
+            }
+        }
+    }
+
     function() = default;
 
     ~function()
@@ -260,12 +416,14 @@ private:
         virtual ReturnType operator()(Args&&...) = 0;
         virtual void copyInto (void*) const = 0;
         virtual FunctorHolderBase<Result, Arguments...>* clone() const = 0;
+        virtual const void* getTypeTag() const = 0;
     };
 
     template <typename Functor, typename ReturnType, typename... Args>
     struct FunctorHolder final : FunctorHolderBase<Result, Arguments...>
     {
-        FunctorHolder (Functor func) : f (func) {}
+        template <typename... CtorArgs>
+        FunctorHolder (CtorArgs&&... ctorArgs) : f (std::forward<CtorArgs> (ctorArgs)...) {}
 
         ReturnType operator()(Args&&... args) override
         {
@@ -282,6 +440,18 @@ private:
             return new FunctorHolder (f);
         }
 
+        // Identifies the holder's type without needing RTTI
+        const void* getTypeTag() const override
+        {
+            return getStaticTypeTag();
+        }
+
+        static const void* getStaticTypeTag()
+        {
+            static const char tag = 0;
+            return &tag;
+        }
+
         Functor f;
     };
 
@@ -291,6 +461,59 @@ private:
 
 }
 
+//=============================================================================
+// The pointer_* wrappers pass their storage pointer to the invoke thunk as the
+// last argument. If the target is a plain function pointer with exactly the
+// wrapper's signature, and every argument is a scalar (so it is passed by
+// value to both the thunk and the target), the function pointer itself can be
+// stored as the invoker. A call then needs only one indirect jump, because on
+// the x86-64 and AArch64 calling conventions the caller owns the argument
+// registers and stack, and the surplus trailing argument is ignored.
+//
+// The standard doesn't sanction calling through a mismatched function pointer
+// type, and Clang's -fsanitize=function and CFI indirect call checks reject
+// it. So this is only enabled on those targets, and builds using such checks
+// should define DIRECT_FUNCTION_POINTER_CALLS=0. Everywhere else plain function
+// pointers go through invoke<Functor> like any other callable.
+#ifndef DIRECT_FUNCTION_POINTER_CALLS
+ #if defined (__x86_64__) || defined (_M_X64) || defined (__aarch64__) || defined (_M_ARM64)
+  #define DIRECT_FUNCTION_POINTER_CALLS 1
+ #else
+  #define DIRECT_FUNCTION_POINTER_CALLS 0
+ #endif
+#endif
+
+namespace direct_calls {
+
+// How a thunk receives each argument: scalars by value, everything else by reference.
+template <typename Argument>
+using parameter = typename std::conditional<std::is_scalar<Argument>::value, Argument, Argument&&>::type;
+
+template <typename... Arguments>
+struct all_scalar : std::true_type {};
+
+template <typename First, typename... Rest>
+struct all_scalar<First, Rest...> : std::integral_constant<bool, std::is_scalar<First>::value && all_scalar<Rest...>::value> {};
+
+template <typename Functor, typename Result, typename... Arguments>
+struct is_direct : std::integral_constant<bool, DIRECT_FUNCTION_POINTER_CALLS
+                                                    && std::is_same<Functor, Result (*)(Arguments...)>::value
+                                                    && all_scalar<Arguments...>::value> {};
+
+template <typename InvokePtr, typename Functor, typename Thunk>
+InvokePtr get_invoker (const Functor&, Thunk thunk, std::false_type)
+{
+    return reinterpret_cast<InvokePtr> (thunk);
+}
+
+template <typename InvokePtr, typename Functor, typename Thunk>
+InvokePtr get_invoker (const Functor& f, Thunk, std::true_type)
+{
+    return reinterpret_cast<InvokePtr> (reinterpret_cast<void (*)()> (f));
+}
+
+}
+
 //=============================================================================
 namespace pointer_heap {
 
@@ -303,7 +526,7 @@ class function<Result (Arguments...)>
 public:
     template <typename Functor>
     function (Functor f)
-        : invokePtr  (reinterpret_cast<invokePtr_t>  (invoke<Functor>)),
+        : invokePtr  (getInvokePtr (f)),
           createPtr  (reinterpret_cast<createPtr_t>  (create<Functor>)),
           destroyPtr (reinterpret_cast<destroyPtr_t> (destroy<Functor>)),
           storageSize (sizeof (Functor)),
@@ -352,6 +575,42 @@ public:
         return *this;
     }
 
+    template <typename Functor,
+              typename = typename std::enable_if<! std::is_same<typename std::decay<Functor>::type, function>::value>::type>
+    function& operator= (Functor&& f)
+    {
+        emplace<typename std::decay<Functor>::type> (std::forward<Functor> (f));
+        return *this;
+    }
+
+    template <typename Functor, typename... Args>
+    void emplace (Args&&... args)
+    {
+        // Take ownership of the old block so that we are left empty if the constructor throws
+        std::unique_ptr<char[]> block (std::move (storage));
+
+        if (block != nullptr)
+        {
+            destroyPtr (block.get());
+
+            // Only the size matters when reusing the heap block
+            if (storageSize != sizeof (Functor))
+                block.reset();
+        }
+
+        if (block == nullptr)
+            block.reset (new char[sizeof (Functor)]);
+
+        auto* f = new (block.get()) Functor (std::forward<Args> (args)...);
+
+        storageSize = sizeof (Functor);
+        storage = std::move (block);
+
+        invokePtr  = getInvokePtr (*f);
+        createPtr  = reinterpret_cast<createPtr_t>  (create<Functor>);
+        destroyPtr = reinterpret_cast<destroyPtr_t> (destroy<Functor>);
+    }
+
     ~function()
     {
         if (storage != nullptr)
@@ -360,16 +619,26 @@ public:
 
     Result operator() (Arguments&&... args) const
     {
-        return invokePtr (storage.get(), std::forward<Arguments> (args)...);
+        return invokePtr (std::forward<Arguments> (args)..., storage.get());
     }
 
 private:
+    using invokePtr_t = Result(*)(direct_calls::parameter<Arguments>..., void*);
+    using createPtr_t = void(*)(void*, void*);
+    using destroyPtr_t = void(*)(void*);
+
     template <typename Functor>
-    static Result invoke (Functor* f, Arguments&&... args)
+    static Result invoke (direct_calls::parameter<Arguments>... args, Functor* f)
     {
         return (*f)(std::forward<Arguments> (args)...);
     }
 
+    template <typename Functor>
+    static invokePtr_t getInvokePtr (const Functor& f)
+    {
+        return direct_calls::get_invoker<invokePtr_t> (f, invoke<Functor>, direct_calls::is_direct<Functor, Result, Arguments...>());
+    }
+
     template <typename Functor>
     static void create (Functor* destination, Functor* source)
     {
@@ -382,10 +651,6 @@ private:
         f->~Functor();
     }
 
-    using invokePtr_t = Result(*)(void*, Arguments&&...);
-    using createPtr_t = void(*)(void*, void*);
-    using destroyPtr_t = void(*)(void*);
-
     invokePtr_t invokePtr;
     createPtr_t createPtr;
     destroyPtr_t destroyPtr;
@@ -408,7 +673,7 @@ class function<Result (Arguments...)>
 public:
     template <typename Functor>
     function (Functor f)
-        : invokePtr  (reinterpret_cast<invokePtr_t>  (invoke<Functor>)),
+        : invokePtr  (getInvokePtr (f)),
           createPtr  (reinterpret_cast<createPtr_t>  (create<Functor>)),
           destroyPtr (reinterpret_cast<destroyPtr_t> (destroy<Functor>))
     {
@@ -448,6 +713,32 @@ public:
         return *this;
     }
 
+    template <typename Functor,
+              typename = typename std::enable_if<! std::is_same<typename std::decay<Functor>::type, function>::value>::type>
+    function& operator= (Functor&& f)
+    {
+        emplace<typename std::decay<Functor>::type> (std::forward<Functor> (f));
+        return *this;
+    }
+
+    template <typename Functor, typename... Args>
+    void emplace (Args&&... args)
+    {
+        static_assert (sizeof (Functor) <= sizeof (stack), "Too big!");
+
+        if (invokePtr != nullptr)
+        {
+            destroyPtr (std::addressof (stack));
+            invokePtr = nullptr;
+        }
+
+        auto* f = new (std::addressof (stack)) Functor (std::forward<Args> (args)...);
+
+        invokePtr  = getInvokePtr (*f);
+        createPtr  = reinterpret_cast<createPtr_t>  (create<Functor>);
+        destroyPtr = reinterpret_cast<destroyPtr_t> (destroy<Functor>);
+    }
+
     function() = default;
 
     ~function()
@@ -458,16 +749,26 @@ public:
 
     Result operator() (Arguments&&... args) const
     {
-        return invokePtr (std::addressof (stack), std::forward<Arguments> (args)...);
+        return invokePtr (std::forward<Arguments> (args)..., std::addressof (stack));
     }
 
 private:
+    using invokePtr_t = Result(*)(direct_calls::parameter<Arguments>..., const void*);
+    using createPtr_t = void(*)(void*, const void*);
+    using destroyPtr_t = void(*)(void*);
+
     template <typename Functor>
-    static Result invoke (Functor* f, Arguments&&... args)
+    static Result invoke (direct_calls::parameter<Arguments>... args, Functor* f)
     {
         return (*f)(std::forward<Arguments> (args)...);
     }
 
+    template <typename Functor>
+    static invokePtr_t getInvokePtr (const Functor& f)
+    {
+        return direct_calls::get_invoker<invokePtr_t> (f, invoke<Functor>, direct_calls::is_direct<Functor, Result, Arguments...>());
+    }
+
     template <typename Functor>
     static void create (Functor* destination, Functor* source)
     {
@@ -480,10 +781,6 @@ private:
         f->~Functor();
     }
 
-    using invokePtr_t = Result(*)(const void*, Arguments&&...);
-    using createPtr_t = void(*)(void*, const void*);
-    using destroyPtr_t = void(*)(void*);
-
     invokePtr_t invokePtr = nullptr;
     createPtr_t createPtr;
     destroyPtr_t destroyPtr;
@@ -505,11 +802,12 @@ class function<Result (Arguments...)>
 public:
     template <typename Functor>
     function (Functor f)
-        : invokePtr  (reinterpret_cast<invokePtr_t>  (invoke<Functor>)),
-          createPtr  (reinterpret_cast<createPtr_t>  (create<Functor>)),
+        : invokePtr  (getInvokePtr (f)),
+          createPtr  (getCreatePtr<Functor>()),
+          movePtr    (reinterpret_cast<movePtr_t>    (move<Functor>)),
           destroyPtr (reinterpret_cast<destroyPtr_t> (destroy<Functor>))
     {
-        if (sizeof (Functor) <= sizeof (stack))
+        if (storesInline<Functor>())
         {
             storagePtr = std::addressof (stack);
         }
@@ -519,7 +817,7 @@ public:
             storagePtr = std::malloc (heapSize);
         }
 
-        createPtr (storagePtr, std::addressof (f));
+        new (storagePtr) Functor (std::move (f));
     }
 
     function (const function& other)
@@ -528,6 +826,7 @@ public:
         {
             invokePtr  = other.invokePtr;
             createPtr  = other.createPtr;
+            movePtr    = other.movePtr;
             destroyPtr = other.destroyPtr;
 
             if (other.storagePtr == std::addressof (other.stack))
@@ -544,6 +843,11 @@ public:
         }
     }
 
+    function (function&& other) noexcept
+    {
+        takeTargetFrom (other);
+    }
+
     function& operator= (function const& other)
     {
         if (storagePtr != nullptr)
@@ -560,6 +864,7 @@ public:
         {
             invokePtr  = other.invokePtr;
             createPtr  = other.createPtr;
+            movePtr    = other.movePtr;
             destroyPtr = other.destroyPtr;
 
             if (other.storagePtr == std::addressof (other.stack))
@@ -578,6 +883,83 @@ public:
         return *this;
     }
 
+    function& operator= (function&& other) noexcept
+    {
+        if (this != std::addressof (other))
+        {
+            if (storagePtr != nullptr)
+            {
+                destroyPtr (storagePtr);
+
+                if (storagePtr != std::addressof (stack))
+                    std::free (storagePtr);
+
+                storagePtr = nullptr;
+            }
+
+            takeTargetFrom (other);
+        }
+
+        return *this;
+    }
+
+    template <typename Functor,
+              typename = typename std::enable_if<! std::is_same<typename std::decay<Functor>::type, function>::value>::type>
+    function& operator= (Functor&& f)
+    {
+        emplace<typename std::decay<Functor>::type> (std::forward<Functor> (f));
+        return *this;
+    }
+
+    template <typename Functor, typename... Args>
+    void emplace (Args&&... args)
+    {
+        const bool storeInline = storesInline<Functor>();
+        void* heapBlock = nullptr;
+
+        if (storagePtr != nullptr)
+        {
+            destroyPtr (storagePtr);
+
+            // Only the size matters when reusing a heap block
+            if (storagePtr != std::addressof (stack))
+            {
+                if (! storeInline && heapSize == (int) sizeof (Functor))
+                    heapBlock = storagePtr;
+                else
+                    std::free (storagePtr);
+            }
+
+            storagePtr = nullptr;
+        }
+
+        if (! storeInline && heapBlock == nullptr)
+            heapBlock = std::malloc (sizeof (Functor));
+
+        void* destination = storeInline ? std::addressof (stack) : heapBlock;
+        Functor* f;
+
+        try
+        {
+            f = new (destination) Functor (std::forward<Args> (args)...);
+        }
+        catch (...)
+        {
+            std::free (heapBlock);
+            throw;
+        }
+
+        if (! storeInline)
+            heapSize = sizeof (Functor);
+
+        storagePtr = destination;
+
+        invokePtr  = getInvokePtr (*f);
+        createPtr  = getCreatePtr<Functor>();
+        movePtr    = reinterpret_cast<movePtr_t>    (move<Functor>);
+        destroyPtr = reinterpret_cast<destroyPtr_t> (destroy<Functor>);
+    }
+
     function() = default;
 
     ~function()
@@ -593,34 +975,108 @@ public:
 
     Result operator() (Arguments... args) const
     {
-        return invokePtr (storagePtr, std::forward<Arguments> (args)...);
+        return invokePtr (std::forward<Arguments> (args)..., storagePtr);
     }
 
 private:
+    // Only functors that can't throw when moved are kept inline, so that moving
+    // a function never throws.
+    template <typename Functor>
+    static constexpr bool storesInline()
+    {
+        return sizeof (Functor) <= sizeof (typename std::aligned_storage<24>::type)
+                 && std::is_nothrow_move_constructible<Functor>::value;
+    }
+
+    // Heap blocks are handed over as they are, and inline targets are moved
+    // across. Either way other is left empty.
+    void takeTargetFrom (function& other) noexcept
+    {
+        if (other.storagePtr == nullptr)
+            return;
+
+        invokePtr  = other.invokePtr;
+        createPtr  = other.createPtr;
+        movePtr    = other.movePtr;
+        destroyPtr = other.destroyPtr;
+
+        if (other.storagePtr == std::addressof (other.stack))
+        {
+            movePtr (std::addressof (stack), other.storagePtr);
+            storagePtr = std::addressof (stack);
+        }
+        else
+        {
+            heapSize = other.heapSize;
+            storagePtr = other.storagePtr;
+        }
+
+        other.storagePtr = nullptr;
+    }
+
+    using invokePtr_t = Result(*)(direct_calls::parameter<Arguments>..., const void*);
+    using createPtr_t = void(*)(void*, const void*);
+    using movePtr_t = void(*)(void*, void*);
+    using destroyPtr_t = void(*)(void*);
+
     template <typename Functor>
-    static Result invoke (Functor* f, Arguments&&... args)
+    static Result invoke (direct_calls::parameter<Arguments>... args, Functor* f)
     {
         return (*f)(std::forward<Arguments> (args)...);
     }
 
+    template <typename Functor>
+    static invokePtr_t getInvokePtr (const Functor& f)
+    {
+        return direct_calls::get_invoker<invokePtr_t> (f, invoke<Functor>, direct_calls::is_direct<Functor, Result, Arguments...>());
+    }
+
     template <typename Functor>
     static void create (Functor* destination, Functor* source)
     {
         new (destination) Functor (*source);
     }
 
+    // Move-only targets can be stored, but copying a function holding one is a logic error
+    static void createMoveOnly (void*, const void*)
+    {
+        std::terminate();
+    }
+
+    template <typename Functor>
+    static createPtr_t getCreatePtr()
+    {
+        return getCreatePtr<Functor> (std::is_copy_constructible<Functor>());
+    }
+
+    template <typename Functor>
+    static createPtr_t getCreatePtr (std::true_type)
+    {
+        return reinterpret_cast<createPtr_t> (create<Functor>);
+    }
+
+    template <typename Functor>
+    static createPtr_t getCreatePtr (std::false_type)
+    {
+        return createMoveOnly;
+    }
+
+    template <typename Functor>
+    static void move (Functor* destination, Functor* source)
+    {
+        new (destination) Functor (std::move (*source));
+        source->~Functor();
+    }
+
     template <typename Functor>
     static void destroy (Functor* f)
     {
         f->~Functor();
     }
 
-    using invokePtr_t = Result(*)(const void*, Arguments&&...);
-    using createPtr_t = void(*)(void*, const void*);
-    using destroyPtr_t = void(*)(void*);
-
     invokePtr_t invokePtr;
     createPtr_t createPtr;
+    movePtr_t movePtr;
     destroyPtr_t destroyPtr;
 
     typename std::aligned_storage<24>::type stack;
@@ -631,133 +1087,1192 @@ private:
 }
 
 //=============================================================================
-namespace non_type_erased {
+namespace relocation {
 
-template <typename>
-class function;
+// A type is trivially relocatable if moving it to a new address and
+// forgetting the old one is equivalent to a memcpy. Anything trivially
+// copyable qualifies, and wrappers without self-referential pointers can
+// opt in by specialising this.
+template <typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
 
-template <typename Result, typename... Arguments>
-class function<Result (Arguments...)>
+template <typename T>
+class relocating_vector
 {
 public:
-    template <typename Functor>
-    function (Functor f)
-        : functionPtr  (f)
-    {}
+    relocating_vector() = default;
 
-    function() = default;
+    relocating_vector (const relocating_vector&) = delete;
+    relocating_vector& operator= (const relocating_vector&) = delete;
 
-    Result operator() (Arguments&&... args) const
+    ~relocating_vector()
     {
-        return functionPtr (std::forward<Arguments> (args)...);
-    }
+        for (size_t i = 0; i < numElements; ++i)
+            elements[i].~T();
 
-    Result(*functionPtr)(Arguments...) = nullptr;
-};
+        std::free (elements);
+    }
 
-}
+    void push_back (const T& value)
+    {
+        if (numElements == numAllocated)
+        {
+            auto newNumAllocated = numAllocated == 0 ? 4 : numAllocated * 2;
+            auto newElements = static_cast<T*> (std::malloc (newNumAllocated * sizeof (T)));
 
-//=============================================================================
-namespace polymorphic_stack {
+            // Copy the new value first in case it refers to an existing element.
+            new (newElements + numElements) T (value);
+            relocate (newElements, elements, numElements);
+
+            std::free (elements);
+            elements = newElements;
+            numAllocated = newNumAllocated;
+        }
+        else
+        {
+            new (elements + numElements) T (value);
+        }
+
+        ++numElements;
+    }
+
+    T* erase (T* position)
+    {
+        position->~T();
+        relocate (position, position + 1, (size_t) (end() - position - 1));
+        --numElements;
+        return position;
+    }
+
+    T& operator[] (size_t index)   { return elements[index]; }
+    size_t size() const            { return numElements; }
+    T* data()                      { return elements; }
+    T* begin()                     { return elements; }
+    T* end()                       { return elements + numElements; }
+
+private:
+    // The destination may overlap the source provided it precedes it.
+    static void relocate (T* destination, T* source, size_t count)
+    {
+        relocate (destination, source, count, is_trivially_relocatable<T>());
+    }
+
+    static void relocate (T* destination, T* source, size_t count, std::true_type)
+    {
+        if (count != 0)
+            std::memmove (static_cast<void*> (destination), source, count * sizeof (T));
+    }
+
+    static void relocate (T* destination, T* source, size_t count, std::false_type)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            new (destination + i) T (std::move (source[i]));
+            source[i].~T();
+        }
+    }
+
+    T* elements = nullptr;
+    size_t numElements = 0, numAllocated = 0;
+};
+
+}
+
+//=============================================================================
+namespace pointer_relocatable {
+
+template <typename>
+class function;
+
+// Like pointer_stack_or_heap, but without a pointer into its own storage, so
+// the whole object can be moved around with memcpy. Only trivially copyable
+// functors are kept inline; anything else lives on the heap, where it is
+// unaffected by relocating the wrapper.
+template <typename Result, typename... Arguments>
+class function<Result (Arguments...)>
+{
+public:
+    template <typename Functor>
+    function (Functor f)
+        : invokePtr  (getInvokePtr (f)),
+          createPtr  (reinterpret_cast<createPtr_t>  (create<Functor>)),
+          destroyPtr (reinterpret_cast<destroyPtr_t> (destroy<Functor>))
+    {
+        if (! (sizeof (Functor) <= sizeof (stack) && std::is_trivially_copyable<Functor>::value))
+        {
+            heapSize = sizeof (Functor);
+            heapPtr = std::malloc (heapSize);
+        }
+
+        createPtr (getStorage(), std::addressof (f));
+    }
+
+    function (const function& other)
+    {
+        if (other.invokePtr != nullptr)
+        {
+            invokePtr  = other.invokePtr;
+            createPtr  = other.createPtr;
+            destroyPtr = other.destroyPtr;
+
+            if (other.heapPtr != nullptr)
+            {
+                heapSize = other.heapSize;
+                heapPtr = std::malloc (heapSize);
+            }
+
+            createPtr (getStorage(), other.getStorage());
+        }
+    }
+
+    function& operator= (function const& other)
+    {
+        if (invokePtr != nullptr)
+        {
+            destroyPtr (getStorage());
+            std::free (heapPtr);
+
+            invokePtr = nullptr;
+            heapPtr = nullptr;
+        }
+
+        if (other.invokePtr != nullptr)
+        {
+            invokePtr  = other.invokePtr;
+            createPtr  = other.createPtr;
+            destroyPtr = other.destroyPtr;
+
+            if (other.heapPtr != nullptr)
+            {
+                heapSize = other.heapSize;
+                heapPtr = std::malloc (heapSize);
+            }
+
+            createPtr (getStorage(), other.getStorage());
+        }
+
+        return *this;
+    }
+
+    template <typename Functor,
+              typename = typename std::enable_if<! std::is_same<typename std::decay<Functor>::type, function>::value>::type>
+    function& operator= (Functor&& f)
+    {
+        emplace<typename std::decay<Functor>::type> (std::forward<Functor> (f));
+        return *this;
+    }
+
+    template <typename Functor, typename... Args>
+    void emplace (Args&&... args)
+    {
+        const bool storeInline = sizeof (Functor) <= sizeof (stack) && std::is_trivially_copyable<Functor>::value;
+        void* heapBlock = nullptr;
+
+        if (invokePtr != nullptr)
+        {
+            destroyPtr (getStorage());
+            invokePtr = nullptr;
+
+            // Only the size matters when reusing a heap block
+            if (heapPtr != nullptr && ! storeInline && heapSize == (int) sizeof (Functor))
+                heapBlock = heapPtr;
+            else
+                std::free (heapPtr);
+
+            heapPtr = nullptr;
+        }
+
+        if (! storeInline && heapBlock == nullptr)
+            heapBlock = std::malloc (sizeof (Functor));
+
+        void* destination = storeInline ? std::addressof (stack) : heapBlock;
+        Functor* f;
+
+        try
+        {
+            f = new (destination) Functor (std::forward<Args> (args)...);
+        }
+        catch (...)
+        {
+            std::free (heapBlock);
+            throw;
+        }
+
+        if (! storeInline)
+            heapSize = sizeof (Functor);
+
+        heapPtr = heapBlock;
+
+        invokePtr  = getInvokePtr (*f);
+        createPtr  = reinterpret_cast<createPtr_t>  (create<Functor>);
+        destroyPtr = reinterpret_cast<destroyPtr_t> (destroy<Functor>);
+    }
+
+    function() = default;
+
+    ~function()
+    {
+        if (invokePtr != nullptr)
+        {
+            destroyPtr (getStorage());
+            std::free (heapPtr);
+        }
+    }
+
+    Result operator() (Arguments... args) const
+    {
+        return invokePtr (std::forward<Arguments> (args)..., getStorage());
+    }
+
+private:
+    using invokePtr_t = Result(*)(direct_calls::parameter<Arguments>..., const void*);
+    using createPtr_t = void(*)(void*, const void*);
+    using destroyPtr_t = void(*)(void*);
+
+    template <typename Functor>
+    static Result invoke (direct_calls::parameter<Arguments>... args, Functor* f)
+    {
+        return (*f)(std::forward<Arguments> (args)...);
+    }
+
+    template <typename Functor>
+    static invokePtr_t getInvokePtr (const Functor& f)
+    {
+        return direct_calls::get_invoker<invokePtr_t> (f, invoke<Functor>, direct_calls::is_direct<Functor, Result, Arguments...>());
+    }
+
+    template <typename Functor>
+    static void create (Functor* destination, Functor* source)
+    {
+        new (destination) Functor (*source);
+    }
+
+    template <typename Functor>
+    static void destroy (Functor* f)
+    {
+        f->~Functor();
+    }
+
+    void* getStorage() const
+    {
+        return heapPtr != nullptr ? heapPtr : const_cast<void*> (static_cast<const void*> (std::addressof (stack)));
+    }
+
+    invokePtr_t invokePtr = nullptr;
+    createPtr_t createPtr;
+    destroyPtr_t destroyPtr;
+
+    typename std::aligned_storage<24>::type stack;
+    int heapSize;
+    void* heapPtr = nullptr;
+};
+
+}
+
+namespace relocation {
+
+template <typename Signature>
+struct is_trivially_relocatable<pointer_relocatable::function<Signature>> : std::true_type {};
+
+}
+
+//=============================================================================
+namespace pointer_overloaded {
+
+namespace detail {
+
+template <typename>
+struct invoker;
+
+template <typename Result, typename... Arguments>
+struct invoker<Result (Arguments...)>
+{
+    using type = Result(*)(void*, Arguments&&...);
+
+    template <typename Functor>
+    static Result invoke (void* f, Arguments&&... args)
+    {
+        return (*static_cast<Functor*> (f)) (std::forward<Arguments> (args)...);
+    }
+};
+
+// Provides one operator() per signature, each forwarding to the matching
+// entry in the derived class's operations table.
+template <typename Derived, size_t index, typename... Signatures>
+struct call_operators;
+
+template <typename Derived, size_t index, typename Result, typename... Arguments>
+struct call_operators<Derived, index, Result (Arguments...)>
+{
+    Result operator() (Arguments... args) const
+    {
+        return static_cast<const Derived&> (*this).template invoke<index, Result, Arguments...> (std::forward<Arguments> (args)...);
+    }
+};
+
+template <typename Derived, size_t index, typename Result, typename... Arguments, typename Next, typename... Rest>
+struct call_operators<Derived, index, Result (Arguments...), Next, Rest...> : call_operators<Derived, index + 1, Next, Rest...>
+{
+    using call_operators<Derived, index + 1, Next, Rest...>::operator();
+
+    Result operator() (Arguments... args) const
+    {
+        return static_cast<const Derived&> (*this).template invoke<index, Result, Arguments...> (std::forward<Arguments> (args)...);
+    }
+};
+
+}
+
+// Stores a single callable with several operator()s, using the same inline
+// storage as pointer_stack_or_heap. The per-type operations live in a shared
+// static table, so each wrapper only carries a single pointer to them.
+template <typename... Signatures>
+class overloaded_function : public detail::call_operators<overloaded_function<Signatures...>, 0, Signatures...>
+{
+public:
+    template <typename Functor>
+    overloaded_function (Functor f)
+    {
+        emplace<Functor> (std::move (f));
+    }
+
+    overloaded_function (const overloaded_function& other)
+    {
+        if (other.storagePtr != nullptr)
+        {
+            operations = other.operations;
+
+            if (other.storagePtr == std::addressof (other.stack))
+            {
+                storagePtr = std::addressof (stack);
+            }
+            else
+            {
+                heapSize = other.heapSize;
+                storagePtr = std::malloc (heapSize);
+            }
+
+            operations->create (storagePtr, other.storagePtr);
+        }
+    }
+
+    overloaded_function& operator= (overloaded_function const& other)
+    {
+        if (storagePtr != nullptr)
+        {
+            operations->destroy (storagePtr);
+
+            if (storagePtr != std::addressof (stack))
+                std::free (storagePtr);
+
+            storagePtr = nullptr;
+        }
+
+        if (other.storagePtr != nullptr)
+        {
+            operations = other.operations;
+
+            if (other.storagePtr == std::addressof (other.stack))
+            {
+                storagePtr = std::addressof (stack);
+            }
+            else
+            {
+                heapSize = other.heapSize;
+                storagePtr = std::malloc (heapSize);
+            }
+
+            operations->create (storagePtr, other.storagePtr);
+        }
+
+        return *this;
+    }
+
+    template <typename Functor,
+              typename = typename std::enable_if<! std::is_same<typename std::decay<Functor>::type, overloaded_function>::value>::type>
+    overloaded_function& operator= (Functor&& f)
+    {
+        emplace<typename std::decay<Functor>::type> (std::forward<Functor> (f));
+        return *this;
+    }
+
+    template <typename Functor, typename... Args>
+    void emplace (Args&&... args)
+    {
+        const bool storeInline = sizeof (Functor) <= sizeof (stack);
+        void* heapBlock = nullptr;
+
+        if (storagePtr != nullptr)
+        {
+            operations->destroy (storagePtr);
+
+            // Only the size matters when reusing a heap block
+            if (storagePtr != std::addressof (stack))
+            {
+                if (! storeInline && heapSize == (int) sizeof (Functor))
+                    heapBlock = storagePtr;
+                else
+                    std::free (storagePtr);
+            }
+
+            storagePtr = nullptr;
+        }
+
+        if (! storeInline && heapBlock == nullptr)
+            heapBlock = std::malloc (sizeof (Functor));
+
+        void* destination = storeInline ? std::addressof (stack) : heapBlock;
+
+        try
+        {
+            new (destination) Functor (std::forward<Args> (args)...);
+        }
+        catch (...)
+        {
+            std::free (heapBlock);
+            throw;
+        }
+
+        if (! storeInline)
+            heapSize = sizeof (Functor);
+
+        storagePtr = destination;
+        operations = getOperations<Functor>();
+    }
+
+    overloaded_function() = default;
+
+    ~overloaded_function()
+    {
+        if (storagePtr != nullptr)
+        {
+            operations->destroy (storagePtr);
+
+            if (storagePtr != std::addressof (stack))
+                std::free (storagePtr);
+        }
+    }
+
+private:
+    template <typename, size_t, typename...>
+    friend struct detail::call_operators;
+
+    template <size_t index, typename Result, typename... Arguments>
+    Result invoke (Arguments&&... args) const
+    {
+        return std::get<index> (operations->invokers) (storagePtr, std::forward<Arguments> (args)...);
+    }
+
+    template <typename Functor>
+    static void create (void* destination, const void* source)
+    {
+        new (destination) Functor (*static_cast<const Functor*> (source));
+    }
+
+    template <typename Functor>
+    static void destroy (void* f)
+    {
+        static_cast<Functor*> (f)->~Functor();
+    }
+
+    struct Operations
+    {
+        std::tuple<typename detail::invoker<Signatures>::type...> invokers;
+        void (*create) (void*, const void*);
+        void (*destroy) (void*);
+    };
+
+    template <typename Functor>
+    static const Operations* getOperations()
+    {
+        static const Operations operationsForFunctor { std::make_tuple (&detail::invoker<Signatures>::template invoke<Functor>...),
+                                                       &create<Functor>,
+                                                       &destroy<Functor> };
+        return &operationsForFunctor;
+    }
+
+    const Operations* operations = nullptr;
+
+    typename std::aligned_storage<24>::type stack;
+    int heapSize;
+    void* storagePtr = nullptr;
+};
+
+}
+
+//=============================================================================
+namespace pointer_block {
+
+template <typename>
+class block_function;
+
+// Wraps an element-wise callable, but is invoked on whole blocks of data. The
+// loop over the block is instantiated inside the per-type thunk, so it can be
+// vectorised and there is only a single indirect call per block.
+template <typename Result, typename Argument>
+class block_function<Result (Argument)>
+{
+public:
+    template <typename Functor>
+    block_function (Functor f)
+        : processPtr (reinterpret_cast<processPtr_t> (process<Functor>)),
+          createPtr  (reinterpret_cast<createPtr_t>  (create<Functor>)),
+          destroyPtr (reinterpret_cast<destroyPtr_t> (destroy<Functor>))
+    {
+        if (sizeof (Functor) <= sizeof (stack))
+        {
+            storagePtr = std::addressof (stack);
+        }
+        else
+        {
+            heapSize = sizeof (Functor);
+            storagePtr = std::malloc (heapSize);
+        }
+
+        createPtr (storagePtr, std::addressof (f));
+    }
+
+    block_function (const block_function& other)
+    {
+        if (other.storagePtr != nullptr)
+        {
+            processPtr = other.processPtr;
+            createPtr  = other.createPtr;
+            destroyPtr = other.destroyPtr;
+
+            if (other.storagePtr == std::addressof (other.stack))
+            {
+                storagePtr = std::addressof (stack);
+            }
+            else
+            {
+                heapSize = other.heapSize;
+                storagePtr = std::malloc (heapSize);
+            }
+
+            createPtr (storagePtr, other.storagePtr);
+        }
+    }
+
+    block_function& operator= (block_function const& other)
+    {
+        if (storagePtr != nullptr)
+        {
+            destroyPtr (storagePtr);
+
+            if (storagePtr != std::addressof (stack))
+                std::free (storagePtr);
+
+            storagePtr = nullptr;
+        }
+
+        if (other.storagePtr != nullptr)
+        {
+            processPtr = other.processPtr;
+            createPtr  = other.createPtr;
+            destroyPtr = other.destroyPtr;
+
+            if (other.storagePtr == std::addressof (other.stack))
+            {
+                storagePtr = std::addressof (stack);
+            }
+            else
+            {
+                heapSize = other.heapSize;
+                storagePtr = std::malloc (heapSize);
+            }
+
+            createPtr (storagePtr, other.storagePtr);
+        }
+
+        return *this;
+    }
+
+    template <typename Functor,
+              typename = typename std::enable_if<! std::is_same<typename std::decay<Functor>::type, block_function>::value>::type>
+    block_function& operator= (Functor&& f)
+    {
+        emplace<typename std::decay<Functor>::type> (std::forward<Functor> (f));
+        return *this;
+    }
+
+    template <typename Functor, typename... Args>
+    void emplace (Args&&... args)
+    {
+        const bool storeInline = sizeof (Functor) <= sizeof (stack);
+        void* heapBlock = nullptr;
+
+        if (storagePtr != nullptr)
+        {
+            destroyPtr (storagePtr);
+
+            // Only the size matters when reusing a heap block
+            if (storagePtr != std::addressof (stack))
+            {
+                if (! storeInline && heapSize == (int) sizeof (Functor))
+                    heapBlock = storagePtr;
+                else
+                    std::free (storagePtr);
+            }
+
+            storagePtr = nullptr;
+        }
+
+        if (! storeInline && heapBlock == nullptr)
+            heapBlock = std::malloc (sizeof (Functor));
+
+        void* destination = storeInline ? std::addressof (stack) : heapBlock;
+
+        try
+        {
+            new (destination) Functor (std::forward<Args> (args)...);
+        }
+        catch (...)
+        {
+            std::free (heapBlock);
+            throw;
+        }
+
+        if (! storeInline)
+            heapSize = sizeof (Functor);
+
+        storagePtr = destination;
+
+        processPtr = reinterpret_cast<processPtr_t> (process<Functor>);
+        createPtr  = reinterpret_cast<createPtr_t>  (create<Functor>);
+        destroyPtr = reinterpret_cast<destroyPtr_t> (destroy<Functor>);
+    }
+
+    block_function() = default;
+
+    ~block_function()
+    {
+        if (storagePtr != nullptr)
+        {
+            destroyPtr (storagePtr);
+
+            if (storagePtr != std::addressof (stack))
+                std::free (storagePtr);
+        }
+    }
+
+    void operator() (const Argument* input, Result* output, size_t numElements) const
+    {
+        processPtr (input, output, numElements, storagePtr);
+    }
+
+private:
+    using processPtr_t = void(*)(const Argument*, Result*, size_t, void*);
+    using createPtr_t = void(*)(void*, const void*);
+    using destroyPtr_t = void(*)(void*);
+
+    template <typename Functor>
+    static void process (const Argument* input, Result* output, size_t numElements, Functor* f)
+    {
+        auto& func = *f;
+
+        for (size_t i = 0; i < numElements; ++i)
+            output[i] = func (input[i]);
+    }
+
+    template <typename Functor>
+    static void create (Functor* destination, Functor* source)
+    {
+        new (destination) Functor (*source);
+    }
+
+    template <typename Functor>
+    static void destroy (Functor* f)
+    {
+        f->~Functor();
+    }
+
+    processPtr_t processPtr;
+    createPtr_t createPtr;
+    destroyPtr_t destroyPtr;
+
+    typename std::aligned_storage<24>::type stack;
+    int heapSize;
+    void* storagePtr = nullptr;
+};
+
+}
+
+//=============================================================================
+namespace non_type_erased {
+
+template <typename>
+class function;
+
+template <typename Result, typename... Arguments>
+class function<Result (Arguments...)>
+{
+public:
+    template <typename Functor>
+    function (Functor f)
+        : functionPtr  (f)
+    {}
+
+    function() = default;
+
+    Result operator() (Arguments&&... args) const
+    {
+        return functionPtr (std::forward<Arguments> (args)...);
+    }
+
+    Result(*functionPtr)(Arguments...) = nullptr;
+};
+
+}
+
+//=============================================================================
+namespace polymorphic_stack {
 
 template <typename>
 class function;
 
-template <typename Result, typename... Arguments>
-class function<Result (Arguments...)>
-{
-public:
-    virtual ~function() {}
-    virtual Result operator() (Arguments&&...) const = 0;
+template <typename Result, typename... Arguments>
+class function<Result (Arguments...)>
+{
+public:
+    virtual ~function() {}
+    virtual Result operator() (Arguments&&...) const = 0;
+};
+
+template <typename, size_t>
+class StackFunction;
+
+template <size_t stackSize, typename Result, typename... Arguments>
+class StackFunction<Result (Arguments...), stackSize> final : public function<Result (Arguments...)>
+{
+public:
+    template <typename Functor>
+    StackFunction (Functor f)
+    {
+        static_assert (sizeof (FunctorHolder<Functor, Result, Arguments...>) <= sizeof (stack), "Too big!");
+        functorHolderPtr = (FunctorHolderBase<Result, Arguments...>*) std::addressof (stack);
+        new (functorHolderPtr) FunctorHolder<Functor, Result, Arguments...> (f);
+    }
+
+    StackFunction (const StackFunction& other)
+    {
+        if (other.functorHolderPtr != nullptr)
+        {
+            functorHolderPtr = (FunctorHolderBase<Result, Arguments...>*) std::addressof (stack);
+            other.functorHolderPtr->copyInto (functorHolderPtr);
+        }
+    }
+
+    StackFunction& operator= (StackFunction const& other)
+    {
+        if (functorHolderPtr != nullptr)
+        {
+            functorHolderPtr->~FunctorHolderBase<Result, Arguments...>();
+            functorHolderPtr = nullptr;
+        }
+
+        if (other.functorHolderPtr != nullptr)
+        {
+            functorHolderPtr = (FunctorHolderBase<Result, Arguments...>*) std::addressof (stack);
+            other.functorHolderPtr->copyInto (functorHolderPtr);
+        }
+
+        return *this;
+    }
+
+    template <typename Functor,
+              typename = typename std::enable_if<! std::is_same<typename std::decay<Functor>::type, StackFunction>::value>::type>
+    StackFunction& operator= (Functor&& f)
+    {
+        emplace<typename std::decay<Functor>::type> (std::forward<Functor> (f));
+        return *this;
+    }
+
+    template <typename Functor, typename... Args>
+    void emplace (Args&&... args)
+    {
+        using Holder = FunctorHolder<Functor, Result, Arguments...>;
+        static_assert (sizeof (Holder) <= sizeof (stack), "Too big!");
+
+        if (functorHolderPtr != nullptr)
+        {
+            functorHolderPtr->~FunctorHolderBase<Result, Arguments...>();
+            functorHolderPtr = nullptr;
+        }
+
+        new (std::addressof (stack)) Holder (std::forward<Args> (args)...);
+        functorHolderPtr = (FunctorHolderBase<Result, Arguments...>*) std::addressof (stack);
+    }
+
+    StackFunction() = default;
+
+    ~StackFunction()
+    {
+        if (functorHolderPtr != nullptr)
+            functorHolderPtr->~FunctorHolderBase<Result, Arguments...>();
+    }
+
+    Result operator() (Arguments&&... args) const override
+    {
+        return (*functorHolderPtr) (std::forward<Arguments> (args)...);
+    }
+
+private:
+    template <typename ReturnType, typename... Args>
+    struct FunctorHolderBase
+    {
+        virtual ~FunctorHolderBase() {}
+        virtual ReturnType operator()(Args&&...) = 0;
+        virtual void copyInto (void*) const = 0;
+    };
+
+    template <typename Functor, typename ReturnType, typename... Args>
+    struct FunctorHolder final : FunctorHolderBase<Result, Arguments...>
+    {
+        template <typename... CtorArgs>
+        FunctorHolder (CtorArgs&&... ctorArgs) : f (std::forward<CtorArgs> (ctorArgs)...) {}
+
+        ReturnType operator()(Args&&... args) override
+        {
+            return f (std::forward<Arguments> (args)...);
+        }
+
+        void copyInto (void* destination) const override
+        {
+            new (destination) FunctorHolder (f);
+        }
+
+        Functor f;
+    };
+
+    FunctorHolderBase<Result, Arguments...>* functorHolderPtr = nullptr;
+    typename std::aligned_storage<stackSize>::type stack;
+};
+
+}
+
+//=============================================================================
+#if __cplusplus >= 202002L
+
+namespace coroutine_executor {
+
+// Recycles coroutine frames through per-thread caches of free blocks,
+// bucketed by size. A frame is often freed on a different thread to the one
+// that allocated it, so a cache that grows too large hands half of its blocks
+// to a shared pool, and an empty cache refills from there before falling back
+// to malloc.
+class frame_pool
+{
+public:
+    static void* allocate (size_t size)
+    {
+        auto bucket = getBucket (size);
+
+        if (bucket >= numBuckets)
+            return std::malloc (size);
+
+        auto& cache = getCache();
+        auto& freeList = cache.freeLists[bucket];
+
+        if (freeList.head == nullptr)
+            cache.shared.refill (bucket, freeList);
+
+        if (freeList.head == nullptr)
+            return std::malloc ((bucket + 1) * granularity);
+
+        return freeList.pop();
+    }
+
+    static void deallocate (void* ptr, size_t size)
+    {
+        auto bucket = getBucket (size);
+
+        if (bucket >= numBuckets)
+        {
+            std::free (ptr);
+            return;
+        }
+
+        auto& cache = getCache();
+        auto& freeList = cache.freeLists[bucket];
+
+        freeList.push (static_cast<FreeBlock*> (ptr));
+
+        if (freeList.count > maxCachedBlocks)
+            cache.shared.release (bucket, freeList, freeList.count / 2);
+    }
+
+private:
+    static constexpr size_t granularity = 64, numBuckets = 16, maxCachedBlocks = 64;
+
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    struct FreeList
+    {
+        void push (FreeBlock* block)
+        {
+            block->next = head;
+            head = block;
+            ++count;
+        }
+
+        FreeBlock* pop()
+        {
+            auto* block = head;
+            head = block->next;
+            --count;
+            return block;
+        }
+
+        void moveBlocksTo (FreeList& destination, size_t numBlocks)
+        {
+            while (numBlocks-- > 0 && head != nullptr)
+                destination.push (pop());
+        }
+
+        FreeBlock* head = nullptr;
+        size_t count = 0;
+    };
+
+    struct SharedPool
+    {
+        ~SharedPool()
+        {
+            for (auto& freeList : freeLists)
+                while (freeList.head != nullptr)
+                    std::free (freeList.pop());
+        }
+
+        void refill (size_t bucket, FreeList& destination)
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            freeLists[bucket].moveBlocksTo (destination, maxCachedBlocks / 2);
+        }
+
+        void release (size_t bucket, FreeList& source, size_t numBlocks)
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            source.moveBlocksTo (freeLists[bucket], numBlocks);
+        }
+
+        std::mutex mutex;
+        FreeList freeLists[numBuckets];
+    };
+
+    struct Cache
+    {
+        // Fetching the shared pool here guarantees that it outlives every cache
+        Cache() : shared (getSharedPool()) {}
+
+        ~Cache()
+        {
+            for (size_t i = 0; i < numBuckets; ++i)
+                shared.release (i, freeLists[i], freeLists[i].count);
+        }
+
+        SharedPool& shared;
+        FreeList freeLists[numBuckets];
+    };
+
+    static size_t getBucket (size_t size)
+    {
+        return (size - 1) / granularity;
+    }
+
+    static SharedPool& getSharedPool()
+    {
+        static SharedPool pool;
+        return pool;
+    }
+
+    static Cache& getCache()
+    {
+        thread_local Cache cache;
+        return cache;
+    }
 };
 
-template <typename, size_t>
-class StackFunction;
+// A fire-and-forget coroutine that starts eagerly and destroys its own frame
+// when it finishes.
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() noexcept               { return {}; }
+        std::suspend_never initial_suspend() noexcept   { return {}; }
+        std::suspend_never final_suspend() noexcept     { return {}; }
+        void return_void() noexcept                     {}
+        void unhandled_exception() noexcept             { std::terminate(); }
+
+        static void* operator new (size_t size)              { return frame_pool::allocate (size); }
+        static void operator delete (void* ptr, size_t size) { frame_pool::deallocate (ptr, size); }
+    };
+};
 
-template <size_t stackSize, typename Result, typename... Arguments>
-class StackFunction<Result (Arguments...), stackSize> final : public function<Result (Arguments...)>
+// A growable ring buffer of callables. Items are assigned into existing
+// slots, so once the buffer has reached its working size pushing and popping
+// anything that fits inline in Item doesn't allocate.
+template <typename Item>
+class task_queue
 {
 public:
-    template <typename Functor>
-    StackFunction (Functor f)
+    template <typename Callable>
+    void push (Callable&& callable)
     {
-        static_assert (sizeof (FunctorHolder<Functor, Result, Arguments...>) <= sizeof (stack), "Too big!");
-        functorHolderPtr = (FunctorHolderBase<Result, Arguments...>*) std::addressof (stack);
-        new (functorHolderPtr) FunctorHolder<Functor, Result, Arguments...> (f);
+        if (numItems == items.size())
+            grow();
+
+        items[(head + numItems) & (items.size() - 1)] = std::forward<Callable> (callable);
+        ++numItems;
     }
 
-    StackFunction (const StackFunction& other)
+    bool pop (Item& item)
     {
-        if (other.functorHolderPtr != nullptr)
-        {
-            functorHolderPtr = (FunctorHolderBase<Result, Arguments...>*) std::addressof (stack);
-            other.functorHolderPtr->copyInto (functorHolderPtr);
-        }
+        if (numItems == 0)
+            return false;
+
+        item = std::move (items[head]);
+        items[head] = Item();
+
+        head = (head + 1) & (items.size() - 1);
+        --numItems;
+        return true;
     }
 
-    StackFunction& operator= (StackFunction const& other)
+    bool empty() const
     {
-        if (functorHolderPtr != nullptr)
-        {
-            functorHolderPtr->~FunctorHolderBase<Result, Arguments...>();
-            functorHolderPtr = nullptr;
-        }
+        return numItems == 0;
+    }
 
-        if (other.functorHolderPtr != nullptr)
-        {
-            functorHolderPtr = (FunctorHolderBase<Result, Arguments...>*) std::addressof (stack);
-            other.functorHolderPtr->copyInto (functorHolderPtr);
-        }
+private:
+    void grow()
+    {
+        std::vector<Item> newItems (items.empty() ? 64 : items.size() * 2);
 
-        return *this;
+        for (size_t i = 0; i < numItems; ++i)
+            newItems[i] = std::move (items[(head + i) & (items.size() - 1)]);
+
+        items.swap (newItems);
+        head = 0;
     }
 
-    StackFunction() = default;
+    std::vector<Item> items;
+    size_t head = 0, numItems = 0;
+};
 
-    ~StackFunction()
+template <typename Executor>
+struct schedule_awaiter
+{
+    bool await_ready() const noexcept                 { return false; }
+    void await_suspend (std::coroutine_handle<> handle) { executor.post (handle); }
+    void await_resume() const noexcept                {}
+
+    Executor& executor;
+};
+
+// Runs everything posted to it on the thread that calls run().
+template <typename Item = pointer_stack_or_heap::function<void()>>
+class run_loop
+{
+public:
+    schedule_awaiter<run_loop> schedule()
     {
-        if (functorHolderPtr != nullptr)
-            functorHolderPtr->~FunctorHolderBase<Result, Arguments...>();
+        return { *this };
     }
 
-    Result operator() (Arguments&&... args) const override
+    template <typename Callable>
+    void post (Callable&& callable)
     {
-        return (*functorHolderPtr) (std::forward<Arguments> (args)...);
+        queue.push (std::forward<Callable> (callable));
     }
 
-private:
-    template <typename ReturnType, typename... Args>
-    struct FunctorHolderBase
+    // Keeps going until the queue is empty, including anything posted along the way.
+    void run()
     {
-        virtual ~FunctorHolderBase() {}
-        virtual ReturnType operator()(Args&&...) = 0;
-        virtual void copyInto (void*) const = 0;
-    };
+        Item item;
 
-    template <typename Functor, typename ReturnType, typename... Args>
-    struct FunctorHolder final : FunctorHolderBase<Result, Arguments...>
+        while (queue.pop (item))
+            item();
+    }
+
+private:
+    task_queue<Item> queue;
+};
+
+// Runs everything posted to it on a fixed set of worker threads, which drain
+// the queue before the pool is destroyed.
+template <typename Item = pointer_stack_or_heap::function<void()>>
+class thread_pool
+{
+public:
+    explicit thread_pool (size_t numThreads)
     {
-        FunctorHolder (Functor func) : f (func) {}
+        for (size_t i = 0; i < numThreads; ++i)
+            threads.emplace_back ([this] { runWorker(); });
+    }
 
-        ReturnType operator()(Args&&... args) override
+    ~thread_pool()
+    {
         {
-            return f (std::forward<Arguments> (args)...);
+            std::lock_guard<std::mutex> lock (mutex);
+            stopping = true;
         }
 
-        void copyInto (void* destination) const override
+        condition.notify_all();
+
+        for (auto& t : threads)
+            t.join();
+    }
+
+    schedule_awaiter<thread_pool> schedule()
+    {
+        return { *this };
+    }
+
+    template <typename Callable>
+    void post (Callable&& callable)
+    {
         {
-            new (destination) FunctorHolder (f);
+            std::lock_guard<std::mutex> lock (mutex);
+            queue.push (std::forward<Callable> (callable));
         }
 
-        Functor f;
-    };
+        condition.notify_one();
+    }
 
-    FunctorHolderBase<Result, Arguments...>* functorHolderPtr = nullptr;
-    typename std::aligned_storage<stackSize>::type stack;
+private:
+    void runWorker()
+    {
+        Item item;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock (mutex);
+                condition.wait (lock, [this] { return stopping || ! queue.empty(); });
+
+                if (! queue.pop (item))
+                    return;
+            }
+
+            item();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    task_queue<Item> queue;
+    bool stopping = false;
+    std::vector<std::thread> threads;
 };
 
 }
 
+#endif
+
 //=============================================================================
 int addOne (int x)
 {
@@ -792,8 +2307,269 @@ BENCHMARK_TEMPLATE(test, inheritance_stack_or_heap ::function<int(int)>);
 BENCHMARK_TEMPLATE(test, pointer_heap              ::function<int(int)>);
 BENCHMARK_TEMPLATE(test, pointer_stack             ::function<int(int)>);
 BENCHMARK_TEMPLATE(test, pointer_stack_or_heap     ::function<int(int)>);
+BENCHMARK_TEMPLATE(test, pointer_relocatable       ::function<int(int)>);
 BENCHMARK_TEMPLATE(test, non_type_erased           ::function<int(int)>);
 
+//=============================================================================
+template <typename VectorType>
+static void pushBack (benchmark::State& state)
+{
+    using FunctionType = typename std::decay<decltype (std::declval<VectorType&>()[0])>::type;
+
+    for (auto _ : state)
+    {
+        VectorType functions;
+
+        for (int i = 0; i < state.range (0); ++i)
+            functions.push_back (FunctionType (addOne));
+
+        benchmark::DoNotOptimize (functions.data());
+    }
+}
+BENCHMARK_TEMPLATE(pushBack, std::vector                   <pointer_stack_or_heap::function<int(int)>>)->Range (8, 1024);
+BENCHMARK_TEMPLATE(pushBack, relocation::relocating_vector <pointer_stack_or_heap::function<int(int)>>)->Range (8, 1024);
+BENCHMARK_TEMPLATE(pushBack, relocation::relocating_vector <pointer_relocatable  ::function<int(int)>>)->Range (8, 1024);
+
+template <typename VectorType>
+static void eraseMiddle (benchmark::State& state)
+{
+    using FunctionType = typename std::decay<decltype (std::declval<VectorType&>()[0])>::type;
+
+    for (auto _ : state)
+    {
+        VectorType functions;
+
+        for (int i = 0; i < state.range (0); ++i)
+            functions.push_back (FunctionType (addOne));
+
+        while (functions.size() > 0)
+            functions.erase (functions.begin() + (functions.size() / 2));
+
+        benchmark::DoNotOptimize (functions.data());
+    }
+}
+BENCHMARK_TEMPLATE(eraseMiddle, std::vector                   <pointer_stack_or_heap::function<int(int)>>)->Range (8, 1024);
+BENCHMARK_TEMPLATE(eraseMiddle, relocation::relocating_vector <pointer_stack_or_heap::function<int(int)>>)->Range (8, 1024);
+BENCHMARK_TEMPLATE(eraseMiddle, relocation::relocating_vector <pointer_relocatable  ::function<int(int)>>)->Range (8, 1024);
+
+//=============================================================================
+struct FilterState
+{
+    float coefficient = 0.5f, previous = 0.0f;
+    int sampleRate = 44100;
+};
+
+// A process/reset/prepare set of callbacks that all share the same state.
+struct FilterCallbacks
+{
+    float operator() (float x) const
+    {
+        state->previous = x * state->coefficient + state->previous * (1.0f - state->coefficient);
+        return state->previous;
+    }
+
+    void operator()() const               { state->previous = 0.0f; }
+    void operator() (int sampleRate) const { state->sampleRate = sampleRate; }
+
+    std::shared_ptr<FilterState> state;
+};
+
+struct SeparateCallbacks
+{
+    SeparateCallbacks() = default;
+
+    SeparateCallbacks (FilterCallbacks callbacks)
+        : process (callbacks), reset (callbacks), prepare (callbacks)
+    {}
+
+    float operator() (float x) const       { return process (x); }
+    void operator()() const                { reset(); }
+    void operator() (int sampleRate) const { prepare (sampleRate); }
+
+    pointer_stack_or_heap::function<float (float)> process;
+    pointer_stack_or_heap::function<void()> reset;
+    pointer_stack_or_heap::function<void (int)> prepare;
+};
+
+using OverloadedCallbacks = pointer_overloaded::overloaded_function<float (float), void(), void (int)>;
+
+template <typename CallbacksType>
+static void copyCallbacks (benchmark::State& state)
+{
+    CallbacksType callbacks (FilterCallbacks { std::make_shared<FilterState>() });
+    std::array<CallbacksType, 24> copies;
+
+    for (auto _ : state)
+    {
+        for (auto& c : copies)
+            c = callbacks;
+
+        benchmark::DoNotOptimize (copies.data());
+    }
+
+    state.counters["bytes"] = sizeof (CallbacksType);
+}
+BENCHMARK_TEMPLATE(copyCallbacks, SeparateCallbacks);
+BENCHMARK_TEMPLATE(copyCallbacks, OverloadedCallbacks);
+
+template <typename CallbacksType>
+static void callCallbacks (benchmark::State& state)
+{
+    CallbacksType callbacks (FilterCallbacks { std::make_shared<FilterState>() });
+
+    for (auto _ : state)
+    {
+        callbacks (48000);
+        callbacks();
+
+        float sum = 0.0f;
+        for (int i = 0; i < 64; ++i)
+            sum += callbacks ((float) i);
+
+        benchmark::DoNotOptimize (sum);
+    }
+}
+BENCHMARK_TEMPLATE(callCallbacks, SeparateCallbacks);
+BENCHMARK_TEMPLATE(callCallbacks, OverloadedCallbacks);
+
+//=============================================================================
+struct GainAndClip
+{
+    float operator() (float x) const
+    {
+        return std::min (std::max (x * gain, -1.0f), 1.0f);
+    }
+
+    float gain = 2.0f;
+};
+
+static void perElement (benchmark::State& state)
+{
+    pointer_stack_or_heap::function<float (float)> f (GainAndClip{});
+    std::vector<float> input ((size_t) state.range (0), 0.5f), output (input.size());
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < input.size(); ++i)
+            output[i] = f (input[i]);
+
+        benchmark::DoNotOptimize (output.data());
+    }
+
+    state.SetItemsProcessed (state.iterations() * state.range (0));
+}
+BENCHMARK(perElement)->RangeMultiplier (4)->Range (1, 4096);
+
+static void perBlock (benchmark::State& state)
+{
+    pointer_block::block_function<float (float)> f (GainAndClip{});
+    std::vector<float> input ((size_t) state.range (0), 0.5f), output (input.size());
+
+    for (auto _ : state)
+    {
+        f (input.data(), output.data(), input.size());
+        benchmark::DoNotOptimize (output.data());
+    }
+
+    state.SetItemsProcessed (state.iterations() * state.range (0));
+}
+BENCHMARK(perBlock)->RangeMultiplier (4)->Range (1, 4096);
+
+//=============================================================================
+#if __cplusplus >= 202002L
+
+template <typename Executor>
+static coroutine_executor::task pingPong (Executor& executor, int numRounds, std::atomic<int>& counter)
+{
+    for (int i = 0; i < numRounds; ++i)
+    {
+        co_await executor.schedule();
+        ++counter;
+    }
+}
+
+template <typename Item>
+static void runLoopPingPong (benchmark::State& state)
+{
+    coroutine_executor::run_loop<Item> loop;
+
+    for (auto _ : state)
+    {
+        std::atomic<int> counter { 0 };
+
+        pingPong (loop, 64, counter);
+        pingPong (loop, 64, counter);
+        loop.run();
+
+        benchmark::DoNotOptimize (counter.load());
+    }
+}
+BENCHMARK_TEMPLATE(runLoopPingPong, std::function<void()>);
+BENCHMARK_TEMPLATE(runLoopPingPong, pointer_stack_or_heap::function<void()>);
+
+template <typename Item>
+static void threadPoolPingPong (benchmark::State& state)
+{
+    coroutine_executor::thread_pool<Item> pool (4);
+
+    for (auto _ : state)
+    {
+        std::atomic<int> counter { 0 };
+
+        pingPong (pool, 64, counter);
+        pingPong (pool, 64, counter);
+
+        while (counter.load() != 128)
+            std::this_thread::yield();
+    }
+}
+BENCHMARK_TEMPLATE(threadPoolPingPong, std::function<void()>)->UseRealTime();
+BENCHMARK_TEMPLATE(threadPoolPingPong, pointer_stack_or_heap::function<void()>)->UseRealTime();
+
+template <typename Item>
+static void runLoopFanOut (benchmark::State& state)
+{
+    coroutine_executor::run_loop<Item> loop;
+
+    for (auto _ : state)
+    {
+        int a = 0, b = 0, c = 0;
+
+        for (int i = 0; i < 64; ++i)
+            loop.post ([&a, &b, &c] { ++a; b += a; c ^= b; });
+
+        loop.run();
+
+        benchmark::DoNotOptimize (c);
+    }
+}
+BENCHMARK_TEMPLATE(runLoopFanOut, std::function<void()>);
+BENCHMARK_TEMPLATE(runLoopFanOut, pointer_stack_or_heap::function<void()>);
+
+template <typename Item>
+static void threadPoolFanOut (benchmark::State& state)
+{
+    coroutine_executor::thread_pool<Item> pool (4);
+
+    for (auto _ : state)
+    {
+        std::atomic<int> remaining { 64 };
+        std::atomic<int> sum { 0 };
+
+        for (int i = 0; i < 64; ++i)
+            pool.post ([&remaining, &sum, i] { sum += i; --remaining; });
+
+        while (remaining.load() != 0)
+            std::this_thread::yield();
+
+        benchmark::DoNotOptimize (sum.load());
+    }
+}
+BENCHMARK_TEMPLATE(threadPoolFanOut, std::function<void()>)->UseRealTime();
+BENCHMARK_TEMPLATE(threadPoolFanOut, pointer_stack_or_heap::function<void()>)->UseRealTime();
+
+#endif
+
 // Comment this line out to run on http://quick-bench.com
 BENCHMARK_MAIN();
 